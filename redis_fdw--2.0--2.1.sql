@@ -0,0 +1,25 @@
+/*-------------------------------------------------------------------------
+ *
+ *                foreign-data wrapper for Redis
+ *
+ * Copyright (c) 2011 - 2025, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence
+ *
+ * Author: Dave Page <dpage@pgadmin.org>
+ *
+ * IDENTIFICATION
+ *                redis_fdw/redis_fdw--2.0--2.1.sql
+ *
+ *-------------------------------------------------------------------------
+ */
+
+\echo Use "ALTER EXTENSION redis_fdw UPDATE" to load this file. \quit
+
+CREATE FUNCTION redis_fdw_connect(server name)
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL UNSAFE;
+
+COMMENT ON FUNCTION redis_fdw_connect(name)
+IS 'Opens the connection to a Redis FDW server ahead of its first query';
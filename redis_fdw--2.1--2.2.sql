@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------
+ *
+ *                foreign-data wrapper for Redis
+ *
+ * Copyright (c) 2011 - 2025, PostgreSQL Global Development Group
+ *
+ * This software is released under the PostgreSQL Licence
+ *
+ * Author: Dave Page <dpage@pgadmin.org>
+ *
+ * IDENTIFICATION
+ *                redis_fdw/redis_fdw--2.1--2.2.sql
+ *
+ *-------------------------------------------------------------------------
+ */
+
+\echo Use "ALTER EXTENSION redis_fdw UPDATE" to load this file. \quit
+
+CREATE FUNCTION redis_fdw_client_cache_stats(
+    OUT hits bigint,
+    OUT misses bigint,
+    OUT evictions bigint,
+    OUT invalidations bigint,
+    OUT replies bigint,
+    OUT bytes bigint)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE PARALLEL RESTRICTED;
+
+COMMENT ON FUNCTION redis_fdw_client_cache_stats()
+IS 'Returns the client cache statistics of the current backend';
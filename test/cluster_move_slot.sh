@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Move the hash slot of a key, and the keys in it, from one node of the test
+# cluster to another, as valkey-cli --cluster reshard would:
+#
+#   cluster_move_slot.sh key from_port to_port
+#
+# Every node is told the slot's new owner at once, so that only redis_fdw's
+# own slot map is left out of date, for a MOVED to correct.
+
+set -e
+
+key=$1
+from=$2
+to=$3
+
+slot=$(redis-cli -p "$from" cluster keyslot "$key")
+from_id=$(redis-cli -p "$from" cluster myid)
+to_id=$(redis-cli -p "$to" cluster myid)
+
+redis-cli -p "$to" cluster setslot "$slot" importing "$from_id" > /dev/null
+redis-cli -p "$from" cluster setslot "$slot" migrating "$to_id" > /dev/null
+
+for k in $(redis-cli -p "$from" cluster getkeysinslot "$slot" 1000)
+do
+	redis-cli -p "$from" migrate 127.0.0.1 "$to" "$k" 0 5000 > /dev/null
+done
+
+for port in 7000 7001 7002
+do
+	redis-cli -p "$port" cluster setslot "$slot" node "$to_id" > /dev/null
+done
@@ -1296,6 +1296,525 @@ reset enable_nestloop;
 drop table joinupd_src;
 drop foreign table db15_joinupd;
 
+-- A DELETE restricted only on the key column, or not restricted at all, is
+-- carried out directly in Redis without reading the rows. It must delete
+-- exactly the rows the scan-and-delete path would: keys outside the table's
+-- prefix or keyset, and keys of another type, are not rows of the table.
+
+create foreign table db15_ddel(key text, val text)
+       server localredis
+       options (tablekeyprefix 'ddel_', database '15');
+
+insert into db15_ddel values
+       ('ddel_a', '1'), ('ddel_b', '2'), ('ddel_c1', '3'), ('ddel_c2', '4'),
+       ('ddel_cx', '5'), ('ddel_d', '6'), ('ddel_e', '7');
+
+\! redis-cli -n 15 set other_a v > /dev/null
+
+explain (costs off) delete from db15_ddel where key in ('ddel_a', 'ddel_b');
+explain (costs off) delete from db15_ddel where key like 'ddel\_c%';
+explain (costs off) delete from db15_ddel;
+
+-- not on the key column, or not a literal prefix: scan and delete
+explain (costs off) delete from db15_ddel where val = '6';
+explain (costs off) delete from db15_ddel where key like 'ddel_c_';
+
+delete from db15_ddel where key in ('ddel_a', 'ddel_b', 'other_a');
+
+select * from db15_ddel order by key;
+
+delete from db15_ddel where key like 'ddel\_c%';
+
+select * from db15_ddel order by key;
+
+-- a prefix outside the table's reaches nothing, and one shorter than the
+-- table's reaches only the table's keys
+delete from db15_ddel where key like 'o%';
+
+delete from db15_ddel where key in ('ddel_d');
+
+select * from db15_ddel order by key;
+
+\! redis-cli -n 15 hset ddel_h f v > /dev/null
+
+delete from db15_ddel where key in ('ddel_h');
+delete from db15_ddel where key like 'dd%';
+
+\! redis-cli -n 15 keys 'ddel_*' | sort
+\! redis-cli -n 15 get other_a
+
+\! redis-cli -n 15 del ddel_h other_a > /dev/null
+
+drop foreign table db15_ddel;
+
+create foreign table db15_ddel_ks(key text, value text[])
+       server localredis
+       options (tabletype 'set', tablekeyset 'ddel_ks', database '15');
+
+insert into db15_ddel_ks values
+       ('ddel_k1', '{a,b}'), ('ddel_k2', '{c}'), ('ddel_k3', '{d}');
+
+\! redis-cli -n 15 sadd ddel_ks ddel_gone > /dev/null
+
+delete from db15_ddel_ks where key = 'ddel_k1';
+
+select * from db15_ddel_ks order by key;
+
+\! redis-cli -n 15 smembers ddel_ks | sort
+
+delete from db15_ddel_ks;
+
+\! redis-cli -n 15 exists ddel_ks ddel_k2 ddel_k3
+
+drop foreign table db15_ddel_ks;
+
+create foreign table db15_ddel_1h(key text, value text)
+       server localredis
+       options (tabletype 'hash', singleton_key 'ddel_1h', database '15');
+
+insert into db15_ddel_1h values ('f1', 'v1'), ('f2', 'v2'), ('f3', 'v3');
+
+explain (costs off) delete from db15_ddel_1h where key in ('f1', 'f3');
+
+delete from db15_ddel_1h where key in ('f1', 'f3', 'f4');
+
+select * from db15_ddel_1h order by key;
+
+delete from db15_ddel_1h;
+
+\! redis-cli -n 15 exists ddel_1h
+
+drop foreign table db15_ddel_1h;
+
+-- a key the IN list names twice is still one row, changed and counted once
+
+create foreign table db15_ddup(key text, val text)
+       server localredis
+       options (tablekeyprefix 'ddup_', database '15');
+
+insert into db15_ddup values ('ddup_a', '1'), ('ddup_b', '2');
+
+do $$
+  declare
+    rows bigint;
+  begin
+    update db15_ddup set val = 'x' where key in ('ddup_a', 'ddup_a');
+    get diagnostics rows = row_count;
+    raise notice 'updated % rows', rows;
+  end;
+$$;
+
+select * from db15_ddup order by key;
+
+do $$
+  declare
+    rows bigint;
+  begin
+    delete from db15_ddup where key in ('ddup_a', 'ddup_b', 'ddup_a');
+    get diagnostics rows = row_count;
+    raise notice 'deleted % rows', rows;
+  end;
+$$;
+
+select * from db15_ddup order by key;
+
+drop foreign table db15_ddup;
+
+-- A DELETE that has to scan the table sends the keys to Redis a batch at a
+-- time, each batch as one UNLINK and one SREM from the keyset. A row is
+-- counted as the executor deletes it, and from then on nothing else in the
+-- statement sees it, though its key may still be waiting in the batch.
+
+create foreign table db15_bdel(key text, val text)
+       server localredis
+       options (tablekeyset 'bdel_ks', database '15');
+
+insert into db15_bdel
+select 'bdel_' || x, case when x % 1000 = 0 then 'keep' else 'drop' end
+from generate_series(1, 2500) as x;
+
+do $$
+  declare
+    rows bigint;
+  begin
+    delete from db15_bdel where val = 'drop';
+    get diagnostics rows = row_count;
+    raise notice 'deleted % rows', rows;
+  end;
+$$;
+
+insert into db15_bdel select 'bdel_x' || x, 'drop' from generate_series(1, 5) as x;
+
+-- a row trigger reading the table sees each row gone once it is deleted
+create function bdel_seen() returns trigger language plpgsql as $$
+  begin
+    raise notice '% rows left', (select count(*) from db15_bdel);
+    return old;
+  end;
+$$;
+
+create trigger bdel_seen before delete on db15_bdel
+       for each row execute function bdel_seen();
+
+delete from db15_bdel where val = 'drop';
+
+drop trigger bdel_seen on db15_bdel;
+drop function bdel_seen();
+
+select * from db15_bdel order by key;
+
+\! redis-cli -n 15 scard bdel_ks
+
+delete from db15_bdel;
+
+drop foreign table db15_bdel;
+
+-- An UPDATE overwriting a string or a hash field with a value that doesn't
+-- depend on the row is carried out directly too, as SET ... XX or HSET. It
+-- must neither create rows that don't exist nor touch keys of another type.
+
+create foreign table db15_dupd(key text, val text)
+       server localredis
+       options (tablekeyprefix 'dupd_', database '15');
+
+insert into db15_dupd values ('dupd_a', '1'), ('dupd_b', '2'), ('dupd_c', '3');
+
+\! redis-cli -n 15 hset dupd_h f v > /dev/null
+
+explain (costs off) update db15_dupd set val = 'x' where key in ('dupd_a', 'dupd_b');
+
+-- a value computed from the row, or a new key, needs the row
+explain (costs off) update db15_dupd set val = val || 'x' where key = 'dupd_a';
+explain (costs off) update db15_dupd set key = 'dupd_z' where key = 'dupd_a';
+
+update db15_dupd set val = 'x'
+       where key in ('dupd_a', 'dupd_b', 'dupd_h', 'dupd_nope', 'other');
+
+\! redis-cli -n 15 type dupd_h
+\! redis-cli -n 15 exists dupd_nope other
+
+\! redis-cli -n 15 del dupd_h > /dev/null
+
+select * from db15_dupd order by key;
+
+delete from db15_dupd;
+
+drop foreign table db15_dupd;
+
+create foreign table db15_dupd_1h(key text, val text)
+       server localredis
+       options (tabletype 'hash', singleton_key 'dupd_1h', database '15');
+
+insert into db15_dupd_1h values ('f1', 'v1'), ('f2', 'v2'), ('f3', 'v3');
+
+explain (costs off) update db15_dupd_1h set val = 'new' where key = any ('{f1,f3}');
+
+prepare dupd_upd(text, text) as update db15_dupd_1h set val = $2 where key = $1;
+execute dupd_upd('f2', 'via param');
+execute dupd_upd('f4', 'not a row');
+deallocate dupd_upd;
+
+update db15_dupd_1h set val = 'new' where key in ('f1', 'f3', 'f5');
+
+select * from db15_dupd_1h order by key;
+
+-- more rows than go to Redis in one batch
+insert into db15_dupd_1h select 'b' || x, 'old' from generate_series(1, 2500) as x;
+
+select array_agg('b' || x) as dupd_keys from generate_series(0, 2600) as x \gset
+
+explain (costs off) update db15_dupd_1h set val = 'batched' where key = any (:'dupd_keys');
+update db15_dupd_1h set val = 'batched' where key = any (:'dupd_keys');
+
+select val, count(*) from db15_dupd_1h where key like 'b%' group by val;
+
+delete from db15_dupd_1h;
+
+drop foreign table db15_dupd_1h;
+
+-- value + n and value - n become INCRBY, HINCRBY or ZADD XX INCR: atomic in
+-- Redis, and without creating rows that don't exist.
+
+create foreign table db15_incr(key text, val bigint)
+       server localredis
+       options (tablekeyprefix 'incr_', database '15');
+
+insert into db15_incr values ('incr_a', 10), ('incr_b', 20);
+
+explain (costs off) update db15_incr set val = val + 1 where key = 'incr_a';
+
+update db15_incr set val = val + 5 where key in ('incr_a', 'incr_b', 'incr_nope');
+update db15_incr set val = val - 3 where key = 'incr_b';
+
+-- a repeated key is incremented, and counted, once
+do $$
+  declare
+    rows bigint;
+  begin
+    update db15_incr set val = val + 1 where key in ('incr_a', 'incr_a');
+    get diagnostics rows = row_count;
+    raise notice 'updated % rows', rows;
+  end;
+$$;
+
+select * from db15_incr order by key;
+
+\! redis-cli -n 15 exists incr_nope
+
+delete from db15_incr;
+
+drop foreign table db15_incr;
+
+create foreign table db15_incr_1h(key text, val bigint)
+       server localredis
+       options (tabletype 'hash', singleton_key 'incr_1h', database '15');
+
+insert into db15_incr_1h values ('f1', 1), ('f2', 2);
+
+update db15_incr_1h set val = val + 5 where key in ('f1', 'f2', 'f3');
+
+select * from db15_incr_1h order by key;
+
+\! redis-cli -n 15 hexists incr_1h f3
+
+delete from db15_incr_1h;
+
+drop foreign table db15_incr_1h;
+
+-- INCRBYFLOAT adds in long double and rounds to 17 digits, so a float8 value
+-- is incremented the way PostgreSQL does it, row by row
+
+create foreign table db15_incr_f(key text, val float8)
+       server localredis
+       options (tabletype 'hash', singleton_key 'incr_f', database '15');
+
+insert into db15_incr_f values ('f1', 1.5), ('f2', 0.1);
+
+explain (costs off) update db15_incr_f set val = val + 0.2;
+
+update db15_incr_f set val = val + 0.2;
+
+select key, val, val = 0.1::float8 + 0.2::float8 as same from db15_incr_f order by key;
+
+delete from db15_incr_f;
+
+drop foreign table db15_incr_f;
+
+create foreign table db15_incr_1z(member text, score bigint)
+       server localredis
+       options (tabletype 'zset', singleton_key 'incr_1z', database '15');
+
+insert into db15_incr_1z values ('m1', 1), ('m2', 2);
+
+explain (costs off) update db15_incr_1z set score = score - 1 where member = 'm2';
+
+update db15_incr_1z set score = score - 1 where member = 'm2';
+update db15_incr_1z set score = score + 10 where member in ('m1', 'm9');
+
+select * from db15_incr_1z order by member;
+
+\! redis-cli -n 15 zcard incr_1z
+
+delete from db15_incr_1z;
+
+drop foreign table db15_incr_1z;
+
+-- write_mode 'transaction' buffers writes and sends them as one MULTI/EXEC
+-- at commit.
+
+create server txbogus foreign data wrapper redis_fdw options (write_mode 'bogus');
+
+create server txsrv foreign data wrapper redis_fdw options (write_mode 'transaction');
+
+create user mapping for public server txsrv;
+
+create foreign table db15_tx(key text, val text)
+       server txsrv
+       options (database '15', tablekeyprefix 'tx');
+
+create foreign table db15_tx_check(key text, val text)
+       server localredis
+       options (database '15', tablekeyprefix 'tx');
+
+begin;
+insert into db15_tx values ('tx1', 'a'), ('tx2', 'b');
+select * from db15_tx;
+rollback;
+
+\! redis-cli -n 15 exists tx1 tx2
+
+begin;
+insert into db15_tx values ('tx1', 'a');
+insert into db15_tx values ('tx1', 'b');
+rollback;
+
+begin;
+insert into db15_tx values ('tx1', 'a'), ('tx2', 'b');
+commit;
+
+select * from db15_tx_check order by key;
+
+begin;
+insert into db15_tx values ('tx3', 'c');
+savepoint s1;
+insert into db15_tx values ('tx4', 'd');
+rollback to savepoint s1;
+commit;
+
+select * from db15_tx_check order by key;
+
+delete from db15_tx_check;
+
+drop foreign table db15_tx;
+drop foreign table db15_tx_check;
+drop user mapping for public server txsrv;
+drop server txsrv;
+
+-- write_mode 'unacknowledged' sends the writes without waiting for their
+-- replies, and waits for them all with one PING at the end of the
+-- statement. It applies to COPY FROM as well.
+
+create foreign table db15_unack(key text, val text)
+       server localredis
+       options (tablekeyprefix 'unack_', database '15',
+                write_mode 'unacknowledged');
+
+insert into db15_unack
+select 'unack_' || x, 'v' || x
+from generate_series(1, 2500) as x;
+
+select count(*) from db15_unack;
+
+-- nothing is checked, so an existing row is overwritten
+insert into db15_unack values ('unack_1', 'again');
+
+select * from db15_unack where key = 'unack_1';
+
+copy db15_unack from stdin;
+unack_c1	c1
+unack_c2	c2
+\.
+
+select * from db15_unack where key like 'unack_c%' order by key;
+
+delete from db15_unack;
+
+\! redis-cli -n 15 keys 'unack_*'
+
+drop foreign table db15_unack;
+
+-- min_replicas ends each write statement with one WAIT. With no replicas
+-- it fails after replica_timeout_ms, but the writes are made on the primary.
+
+create foreign table db15_wait(key text, val text)
+       server localredis
+       options (database '15', min_replicas '-1');
+
+create foreign table db15_wait(key text, val text)
+       server localredis
+       options (database '15', tablekeyprefix 'wait_',
+                min_replicas '1', replica_timeout_ms '10');
+
+insert into db15_wait values ('wait_1', 'a');
+
+\! redis-cli -n 15 get wait_1
+
+delete from db15_wait;
+
+alter foreign table db15_wait options (set min_replicas '0');
+
+delete from db15_wait;
+
+\! redis-cli -n 15 exists wait_1
+
+drop foreign table db15_wait;
+
+-- A trailing ttl column shows each key's time to live, and sets it when
+-- written. default_ttl applies to rows inserted without one.
+
+create foreign table db15_ttl(key text, val text, ttl interval)
+       server localredis
+       options (database '15', tablekeyprefix 'ttl_', default_ttl '0');
+
+create foreign table db15_ttl(key text, val text, ttl interval)
+       server localredis
+       options (database '15', tablekeyprefix 'ttl_', default_ttl '1 hour');
+
+insert into db15_ttl values ('ttl_1', 'a', '100 seconds'), ('ttl_2', 'b', null);
+
+select key, val, ttl between '90 seconds' and '100 seconds' as short,
+       ttl > '59 minutes' as long
+from db15_ttl order by key;
+
+-- changing the value keeps the ttl, a NULL ttl removes it
+
+update db15_ttl set val = 'c' where key = 'ttl_1';
+
+update db15_ttl set ttl = null where key = 'ttl_2';
+
+select key, val, ttl between '90 seconds' and '100 seconds' as short,
+       ttl is null as persistent
+from db15_ttl order by key;
+
+\! redis-cli -n 15 ttl ttl_2
+
+create foreign table db15_ttl_ms(key text, val text[], ttl bigint)
+       server localredis
+       options (database '15', tabletype 'set', tablekeyprefix 'ttlms_');
+
+insert into db15_ttl_ms values ('ttlms_1', '{x,y}', 50000);
+
+insert into db15_ttl_ms values ('ttlms_2', '{x,y}', 0);
+
+select key, ttl between 40000 and 50000 as ok from db15_ttl_ms;
+
+delete from db15_ttl;
+
+delete from db15_ttl_ms;
+
+drop foreign table db15_ttl;
+
+drop foreign table db15_ttl_ms;
+
+-- Integers and floats are written without their output functions, but
+-- must come out the same.
+
+create foreign table db15_num_s(key text, val bigint)
+       server localredis
+       options (database '15', tablekeyprefix 'nums_');
+
+insert into db15_num_s values ('nums_1', -9223372036854775808);
+
+\! redis-cli -n 15 get nums_1
+
+create foreign table db15_num_l(key text, val real[])
+       server localredis
+       options (database '15', tabletype 'list', tablekeyprefix 'numl_');
+
+insert into db15_num_l values ('numl_1', '{0.1,-0,3e38}');
+
+\! redis-cli -n 15 lrange numl_1 0 -1
+
+create foreign table db15_num_z(key text, val int[], scores float8[])
+       server localredis
+       options (database '15', tabletype 'zset', tablekeyprefix 'numz_');
+
+insert into db15_num_z values ('numz_1', '{-2147483648,0,7}', '{0.1,-1e300,Infinity}');
+
+select * from db15_num_z;
+
+delete from db15_num_s;
+
+delete from db15_num_l;
+
+delete from db15_num_z;
+
+drop foreign table db15_num_s;
+
+drop foreign table db15_num_l;
+
+drop foreign table db15_num_z;
+
 -- NULL key or value must be rejected with an error, not crash the backend.
 
 create foreign table db15_w_nulls_hash(key text, val text)
@@ -1432,6 +1951,611 @@ commit;
 
 drop foreign table db15_conntest;
 
+-- a reused connection is only PINGed after health_check_interval seconds
+
+create server hcsrv foreign data wrapper redis_fdw
+       options (health_check_interval 'soon');
+
+create server hcsrv foreign data wrapper redis_fdw
+       options (health_check_interval '0');
+
+drop server hcsrv;
+
+-- Unix domain sockets
+
+create server socksrv foreign data wrapper redis_fdw
+       options (address '127.0.0.1', socket_path '/tmp/redis.sock');
+
+create server socksrv foreign data wrapper redis_fdw
+       options (socket_path 'redis.sock');
+
+create server socksrv foreign data wrapper redis_fdw
+       options (socket_path '/nonexistent/redis_fdw_test.sock');
+
+create user mapping for public server socksrv;
+
+create foreign table db15_sock(key text, val text)
+       server socksrv
+       options (database '15');
+
+select * from db15_sock;
+
+drop foreign table db15_sock;
+
+drop user mapping for public server socksrv;
+
+drop server socksrv;
+
+-- socket options are checked, then applied to each new connection
+
+create server optsrv foreign data wrapper redis_fdw
+       options (connect_timeout '1.5');
+
+create server optsrv foreign data wrapper redis_fdw
+       options (tcp_nodelay 'maybe');
+
+create server optsrv foreign data wrapper redis_fdw
+       options (connect_timeout '2000', command_timeout '5000',
+                keepalive_interval '10', tcp_nodelay 'false');
+
+create user mapping for public server optsrv;
+
+create foreign table db15_opt(key text, val text)
+       server optsrv
+       options (database '15', tablekeyprefix 'opt_');
+
+insert into db15_opt values ('opt_1', 'a');
+
+select * from db15_opt;
+
+delete from db15_opt;
+
+drop foreign table db15_opt;
+
+drop user mapping for public server optsrv;
+
+drop server optsrv;
+
+-- the connection proxy needs redis_fdw in shared_preload_libraries
+
+create server proxysrv foreign data wrapper redis_fdw
+       options (use_proxy 'often');
+
+create server proxysrv foreign data wrapper redis_fdw
+       options (use_proxy 'true');
+
+create user mapping for public server proxysrv;
+
+create foreign table db15_proxy(key text, val text)
+       server proxysrv
+       options (database '15');
+
+select * from db15_proxy;
+
+alter foreign table db15_proxy options (add write_mode 'unacknowledged');
+
+select * from db15_proxy;
+
+drop foreign table db15_proxy;
+
+drop user mapping for public server proxysrv;
+
+drop server proxysrv;
+
+-- the test server is not a cluster node
+
+create server clustersrv foreign data wrapper redis_fdw
+       options (cluster 'maybe');
+
+create server clustersrv foreign data wrapper redis_fdw
+       options (cluster 'true');
+
+create user mapping for public server clustersrv;
+
+create foreign table db15_cluster(key text, val text)
+       server clustersrv
+       options (database '15');
+
+select * from db15_cluster;
+
+alter foreign table db15_cluster options (drop database);
+
+select * from db15_cluster;
+
+alter foreign table db15_cluster options (add write_mode 'transaction');
+
+select * from db15_cluster;
+
+drop foreign table db15_cluster;
+
+drop user mapping for public server clustersrv;
+
+drop server clustersrv;
+
+-- no Sentinel is listening on port 1
+
+create server sentinelsrv foreign data wrapper redis_fdw
+       options (sentinel_addresses '127.0.0.1:notaport');
+
+create server sentinelsrv foreign data wrapper redis_fdw
+       options (sentinel_addresses '127.0.0.1:1');
+
+create user mapping for public server sentinelsrv;
+
+create foreign table db15_sentinel(key text, val text)
+       server sentinelsrv
+       options (database '15');
+
+select * from db15_sentinel;
+
+alter server sentinelsrv options (add sentinel_master 'mymaster');
+
+select * from db15_sentinel;
+
+alter server sentinelsrv options (add cluster 'true');
+
+select * from db15_sentinel;
+
+-- A Sentinel on port 26380, watching the test server as mymaster, is asked
+-- after the one on port 1 fails to answer; the server's own port is not used
+
+\! printf 'port 26380\nsentinel monitor mymaster 127.0.0.1 6379 1\n' > test/results/sentinel.conf
+\! redis-server test/results/sentinel.conf --sentinel --daemonize yes --dir test/results > /dev/null
+\! for i in $(seq 50); do redis-cli -p 26380 ping > /dev/null 2>&1 && break; sleep 0.1; done
+
+alter server sentinelsrv options (drop cluster, add port '1',
+       set sentinel_addresses '127.0.0.1:1,127.0.0.1:26380');
+
+insert into db15_sentinel values ('sentinel_a', 'x');
+
+select * from db15_sentinel where key = 'sentinel_a';
+
+\! redis-cli -n 15 get sentinel_a
+
+delete from db15_sentinel where key = 'sentinel_a';
+
+\! redis-cli -p 26380 shutdown nosave > /dev/null 2>&1
+
+drop foreign table db15_sentinel;
+
+drop user mapping for public server sentinelsrv;
+
+drop server sentinelsrv;
+
+-- the only Redis to hand is a primary, so scans fall back to it
+
+create server replsrv foreign data wrapper redis_fdw
+       options (replica_addresses '127.0.0.1:6379,', max_replica_lag '-1');
+
+create server replsrv foreign data wrapper redis_fdw
+       options (replica_addresses '127.0.0.1:6379', max_replica_lag '1024');
+
+create user mapping for public server replsrv;
+
+create foreign table db15_repl(key text, val text)
+       server replsrv
+       options (database '15', tablekeyprefix 'repl_');
+
+insert into db15_repl values ('repl_1', 'a');
+
+select * from db15_repl;
+
+delete from db15_repl;
+
+-- A replica of the test server on port 6380, which takes writes of its own
+-- so as to hold a key the primary doesn't, shows which of them a scan read.
+-- A SELECT reads the replica; once the transaction has written, the primary.
+
+\! redis-server --port 6380 --replicaof 127.0.0.1 6379 --replica-read-only no --save '' --appendonly no --daemonize yes --dir test/results > /dev/null
+\! for i in $(seq 100); do redis-cli -p 6380 info replication | grep -q 'master_link_status:up' && break; sleep 0.1; done
+
+alter server replsrv options (set replica_addresses '127.0.0.1:1,127.0.0.1:6380',
+       set max_replica_lag '0');
+
+insert into db15_repl values ('repl_1', 'a');
+
+\! for i in $(seq 50); do [ "$(redis-cli -p 6380 -n 15 exists repl_1)" = 1 ] && break; sleep 0.1; done
+\! redis-cli -p 6380 -n 15 set repl_2 replica > /dev/null
+
+select * from db15_repl order by key;
+
+begin;
+
+insert into db15_repl values ('repl_3', 'c');
+
+select * from db15_repl order by key;
+
+commit;
+
+delete from db15_repl;
+
+\! redis-cli -p 6380 shutdown nosave > /dev/null 2>&1
+
+alter server replsrv options (add cluster 'true');
+
+select * from db15_repl;
+
+drop foreign table db15_repl;
+
+drop user mapping for public server replsrv;
+
+drop server replsrv;
+
+-- a sharded server of one shard still goes through the routing
+
+create server shardsrv foreign data wrapper redis_fdw
+       options (shard_addresses '127.0.0.1:6379', shard_hash 'rendezvous');
+
+create server shardsrv foreign data wrapper redis_fdw
+       options (shard_addresses '127.0.0.1:6379', shard_hash 'jump');
+
+create user mapping for public server shardsrv;
+
+create foreign table db15_shard(key text, val text)
+       server shardsrv
+       options (database '15', tablekeyprefix 'shard_');
+
+-- a keyset and its keys could be on different shards
+create foreign table db15_shard_ks(key text, val text)
+       server shardsrv
+       options (database '15', tablekeyset 'shard_ks');
+
+select * from db15_shard_ks;
+
+drop foreign table db15_shard_ks;
+
+insert into db15_shard values ('shard_1', 'a'), ('shard_{x}2', 'b');
+
+select * from db15_shard order by key;
+
+select * from db15_shard where key = 'shard_{x}2';
+
+delete from db15_shard;
+
+select count(*) from db15_shard;
+
+-- With a second shard on port 6381, jump hash sends shard_1 to shard_5 to
+-- the first server and shard_6 to shard_8 to the second; reads go where
+-- writes went, and a scan takes in both. It is started empty, rather than
+-- from the dump.rdb the replica above leaves in test/results.
+
+\! redis-server --port 6381 --save '' --appendonly no --daemonize yes --dir test/results --dbfilename shard.rdb > /dev/null
+\! for i in $(seq 50); do redis-cli -p 6381 ping > /dev/null 2>&1 && break; sleep 0.1; done
+
+alter server shardsrv options (set shard_addresses '127.0.0.1:6379,127.0.0.1:6381');
+
+insert into db15_shard select 'shard_' || x, 'v' || x from generate_series(1, 8) as x;
+
+\! for p in 6379 6381; do redis-cli -p $p -n 15 keys 'shard_*' | sort | paste -sd' '; done
+
+select * from db15_shard where key = 'shard_7';
+
+select * from db15_shard order by key;
+
+delete from db15_shard;
+
+\! redis-cli -p 6381 -n 15 dbsize
+
+\! redis-cli -p 6381 shutdown nosave > /dev/null 2>&1
+
+alter server shardsrv options (set shard_hash 'ketama', add replica_addresses '127.0.0.1:6380');
+
+select * from db15_shard;
+
+drop foreign table db15_shard;
+
+drop user mapping for public server shardsrv;
+
+drop server shardsrv;
+
+create server retrysrv foreign data wrapper redis_fdw
+       options (retries 'several');
+
+create server retrysrv foreign data wrapper redis_fdw
+       options (retries '2');
+
+create user mapping for public server retrysrv;
+
+create foreign table db15_retry(key text, val text)
+       server retrysrv
+       options (database '15', tablekeyprefix 'retry_');
+
+insert into db15_retry values ('retry_1', 'a');
+
+select * from db15_retry;
+
+-- A connection is only checked on its first use in a transaction, and
+-- planning uses it first, so a prepared plan is what lets one killed between
+-- two statements of a transaction fail under a scan's first command:
+-- retried on a new connection, the scan goes on; without retries, it fails
+
+prepare retry_q as select * from db15_retry where key = 'retry_1';
+
+begin;
+
+execute retry_q;
+
+\! redis-cli client kill skipme yes type normal > /dev/null
+
+execute retry_q;
+
+commit;
+
+alter server retrysrv options (set retries '0');
+
+begin;
+
+execute retry_q;
+
+\! redis-cli client kill skipme yes type normal > /dev/null
+
+do $$
+  begin
+    execute 'execute retry_q';
+  exception when others then
+    raise notice 'not retried: %', sqlstate;
+  end;
+$$;
+
+rollback;
+
+deallocate retry_q;
+
+delete from db15_retry;
+
+drop foreign table db15_retry;
+
+drop user mapping for public server retrysrv;
+
+drop server retrysrv;
+
+-- redis_fdw_connect opens a server's connection ahead of its first query
+select redis_fdw_connect('localredis');
+
+select * from db15 where key = 'nosuchkey';
+
+select redis_fdw_connect('nosuchsrv');
+
+-- preconnecting happens inside a new backend's first query, whatever it
+-- is, so a server that can't be used, even for its options, only earns a
+-- warning
+
+create server preconnbad foreign data wrapper redis_fdw
+       options (client_cache_size '64');
+
+create user mapping for public server preconnbad;
+
+select current_database() as db \gset
+\setenv PGDATABASE :db
+
+\! PGOPTIONS='-c redis_fdw.preconnect_servers=nosuchsrv,preconnbad,localredis' psql -X -A -t -c "select count(*) from db15 where key = 'nosuchkey'" 2>&1
+
+drop user mapping for public server preconnbad;
+
+drop server preconnbad;
+
+-- tables in different databases of a server share its connection
+create foreign table db14(key text, value text)
+       server localredis
+       options (database '14');
+
+insert into db14 values ('dbshare_1', 'fourteen');
+
+insert into db15 values ('dbshare_1', 'fifteen');
+
+select a.value as v14, b.value as v15
+  from db14 a join db15 b on a.key = b.key
+  where a.key = 'dbshare_1' and b.key = 'dbshare_1';
+
+select * from db14 where key = 'dbshare_1';
+
+delete from db14 where key = 'dbshare_1';
+
+delete from db15 where key = 'dbshare_1';
+
+select * from db14;
+
+drop foreign table db14;
+
+-- a reading statement's scans can each have a connection of their own
+create server lanesrv foreign data wrapper redis_fdw
+       options (max_connections_per_server '0');
+
+create server lanesrv foreign data wrapper redis_fdw
+       options (max_connections_per_server '2');
+
+create user mapping for public server lanesrv;
+
+create foreign table db15_lane(key text, val text)
+       server lanesrv
+       options (database '15', tablekeyprefix 'lane_');
+
+insert into db15_lane values ('lane_1', 'a'), ('lane_2', 'b');
+
+select a.key, b.val from db15_lane a join db15_lane b on a.key = b.key
+  order by a.key;
+
+select key from db15_lane union all select val from db15_lane order by 1;
+
+-- Two cursors are two scans open at once, each on a lane of its own, both
+-- now in database 13; fetched in turn, each SCAN carries on from its own
+-- cursor across several batches
+
+create foreign table db13_lane(key text, val text)
+       server lanesrv
+       options (database '13', tablekeyprefix 'lane_');
+
+insert into db13_lane select 'lane_' || x, 'v' from generate_series(1, 2500) as x;
+
+begin;
+
+declare c1 cursor for select * from db13_lane;
+
+declare c2 cursor for select * from db13_lane;
+
+move forward 1000 in c1;
+
+move forward 1000 in c2;
+
+\! redis-cli client list | grep -c ' db=13 '
+
+move forward all in c1;
+
+move forward all in c2;
+
+commit;
+
+delete from db13_lane;
+
+drop foreign table db13_lane;
+
+delete from db15_lane;
+
+drop foreign table db15_lane;
+
+drop user mapping for public server lanesrv;
+
+drop server lanesrv;
+
+-- protocol 3 switches the connection to RESP3
+create server resp3srv foreign data wrapper redis_fdw
+       options (protocol '4');
+
+create server resp3srv foreign data wrapper redis_fdw
+       options (protocol '3');
+
+create user mapping for public server resp3srv;
+
+create foreign table db15_resp3_zset(key text, val text[], scores float8[])
+       server resp3srv
+       options (database '15', tabletype 'zset', tablekeyprefix 'resp3_');
+
+insert into db15_resp3_zset values ('resp3_a', '{b,c}', '{1.5,2.5}');
+
+select * from db15_resp3_zset;
+
+create foreign table db15_resp3_1key_zset(key text, score float8)
+       server resp3srv
+       options (singleton_key 'resp3_a', tabletype 'zset', database '15');
+
+select * from db15_resp3_1key_zset order by score;
+
+create foreign table db15_resp3_hash(key text, val text[])
+       server resp3srv
+       options (database '15', tabletype 'hash', tablekeyprefix 'resp3_h');
+
+insert into db15_resp3_hash values ('resp3_h1', '{f,1,g,2}');
+
+select * from db15_resp3_hash;
+
+-- The connection really is RESP3: zset scores come back as doubles,
+-- awkward ones included, and HGETALL as a map, which a singleton hash table
+-- reads as rows
+
+\! redis-cli client list | grep -c 'resp=3'
+
+insert into db15_resp3_zset values ('resp3_b', '{w,x,y,z}', '{0.1,1e300,-inf,3}');
+
+select val, scores from db15_resp3_zset where key = 'resp3_b';
+
+create foreign table db15_resp3_1key_zset2(key text, score float8)
+       server resp3srv
+       options (singleton_key 'resp3_b', tabletype 'zset', database '15');
+
+select * from db15_resp3_1key_zset2 order by score;
+
+create foreign table db15_resp3_1key_hash(key text, val text)
+       server resp3srv
+       options (singleton_key 'resp3_h1', tabletype 'hash', database '15');
+
+select * from db15_resp3_1key_hash order by key;
+
+select * from db15_resp3_1key_hash where key = 'g';
+
+drop foreign table db15_resp3_1key_zset2;
+
+drop foreign table db15_resp3_1key_hash;
+
+delete from db15_resp3_hash;
+
+delete from db15_resp3_zset;
+
+drop foreign table db15_resp3_hash;
+
+drop foreign table db15_resp3_1key_zset;
+
+drop foreign table db15_resp3_zset;
+
+drop user mapping for public server resp3srv;
+
+drop server resp3srv;
+
+-- cluster routing only knows RESP2's replies
+create server resp3clu foreign data wrapper redis_fdw
+       options (cluster 'true', protocol '3');
+
+create user mapping for public server resp3clu;
+
+create foreign table resp3clu_t(key text, val text)
+       server resp3clu
+       options (tablekeyprefix 'resp3_');
+
+select * from resp3clu_t;
+
+drop foreign table resp3clu_t;
+
+drop user mapping for public server resp3clu;
+
+drop server resp3clu;
+
+-- client_cache_size answers repeated lookups locally until Redis says the
+-- key has changed
+create server cachesrv foreign data wrapper redis_fdw
+       options (client_cache_size '64');
+
+create user mapping for public server cachesrv;
+
+create foreign table db15_cache(key text, value text)
+       server cachesrv
+       options (database '15', tablekeyprefix 'cache_');
+
+select * from db15_cache where key = 'cache_1';
+
+alter server cachesrv options (add protocol '3');
+
+insert into db15 values ('cache_1', 'a');
+
+select * from db15_cache where key = 'cache_1';
+
+select * from db15_cache where key = 'cache_1';
+
+update db15 set value = 'b' where key = 'cache_1';
+
+select * from db15_cache where key = 'cache_1';
+
+select hits, misses, invalidations, replies
+  from redis_fdw_client_cache_stats();
+
+-- a client that isn't this backend's changes a key the cache holds: Redis
+-- tells the cache, and the next lookup reads the new value
+
+select * from db15_cache where key = 'cache_1';
+
+\! redis-cli -n 15 set cache_1 c > /dev/null
+
+select * from db15_cache where key = 'cache_1';
+
+select hits, misses, invalidations, replies
+  from redis_fdw_client_cache_stats();
+
+delete from db15 where key = 'cache_1';
+
+drop foreign table db15_cache;
+
+drop user mapping for public server cachesrv;
+
+drop server cachesrv;
+
 -- A username with no password must be rejected. Authentication is gated on
 -- the password being set, so accepting a lone username would silently connect
 -- unauthenticated while the operator believed ACL auth was configured.
@@ -1630,6 +2754,11 @@ update db15_zs3 set members = '{a,b,d}', scores = '{1,NaN,3}' where key = 'zs3re
 
 select * from db15_zs3 where key = 'zs3renamed';
 
+-- nor, when the same update also renames the key, may it rename it
+update db15_zs3 set key = 'zs3moved', members = '{a,b,d}', scores = '{1,abc,3}' where key = 'zs3renamed';
+
+select * from db15_zs3 where key in ('zs3renamed', 'zs3moved');
+
 insert into db15_zs3 values ('zs3bad', '{a,b,c}', '{1,2}');
 
 -- infinite scores round-trip; Redis accepts the spelling PostgreSQL emits
@@ -0,0 +1,70 @@
+-- Redis Cluster. These tests need a cluster of three primaries on ports
+-- 7000, 7001 and 7002 of localhost, each serving a third of the slots, as
+-- valkey-cli --cluster create makes it; they are run by
+-- make installcheck-cluster.
+
+create server clustersrv foreign data wrapper redis_fdw
+       options (address '127.0.0.1', port '7000', cluster 'true');
+
+create user mapping for public server clustersrv;
+
+create foreign table cl(key text, val text)
+       server clustersrv
+       options (tablekeyprefix 'cl_');
+
+-- each key goes to the primary serving its slot
+
+insert into cl values ('cl_1', 'a'), ('cl_2', 'b'), ('cl_3', 'c'),
+                      ('cl_4', 'd'), ('cl_5', 'e'), ('cl_6', 'f');
+
+\! for p in 7000 7001 7002; do redis-cli -p $p keys 'cl_*' | sort | paste -sd' '; done
+
+select * from cl where key = 'cl_3';
+
+update cl set val = 'b2' where key = 'cl_2';
+
+\! redis-cli -p 7001 get cl_2
+
+-- a scan, and a count, take in every primary
+
+select * from cl order by key;
+
+select count(*) from cl;
+
+-- A slot that moves after the slot map was read: the node redis_fdw sends
+-- to answers MOVED, and the command is sent again where the slot now is.
+
+\! sh test/cluster_move_slot.sh cl_1 7000 7001
+
+select * from cl where key = 'cl_1';
+
+update cl set val = 'a2' where key = 'cl_1';
+
+\! redis-cli -p 7001 get cl_1
+
+\! sh test/cluster_move_slot.sh cl_1 7001 7000
+
+select * from cl order by key;
+
+delete from cl;
+
+\! for p in 7000 7001 7002; do redis-cli -p $p dbsize; done
+
+-- A keyset table's scripts would touch the keyset and a member together,
+-- on whichever node serves the first of them
+
+create foreign table cl_kset(key text, val text)
+       server clustersrv
+       options (tablekeyset '{cl}:keys');
+
+select * from cl_kset order by key;
+
+drop foreign table cl;
+
+drop foreign table cl_kset;
+
+drop user mapping for public server clustersrv;
+
+drop server clustersrv;
+
+\! for p in 7000 7001 7002; do redis-cli -p $p dbsize; done
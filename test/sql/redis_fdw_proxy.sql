@@ -0,0 +1,83 @@
+
+-- The connection proxy. These tests need the proxy worker running, so
+-- redis_fdw in shared_preload_libraries: they are run by
+-- make installcheck-proxy, against a server started with test/proxy.conf.
+
+select count(*) from pg_stat_activity where backend_type = 'redis_fdw proxy';
+
+create server proxysrv foreign data wrapper redis_fdw
+       options (use_proxy 'true');
+
+create user mapping for public server proxysrv;
+
+create foreign table db15_proxy(key text, val text)
+       server proxysrv
+       options (database '15', tablekeyprefix 'proxy_');
+
+create foreign table db15_proxy_h(key text, val text[])
+       server proxysrv
+       options (database '15', tablekeyprefix 'proxyh_', tabletype 'hash');
+
+-- reads and writes go through the worker's connections
+
+insert into db15_proxy values ('proxy_a', 'x'), ('proxy_b', 'y');
+
+insert into db15_proxy_h values ('proxyh_a', '{f1,v1,f2,v2}');
+
+select * from db15_proxy order by key;
+
+select * from db15_proxy_h;
+
+update db15_proxy set val = 'z' where key = 'proxy_a';
+
+\! redis-cli -n 15 get proxy_a
+
+select * from db15_proxy where key = 'proxy_a';
+
+-- A backend that goes away with a command in flight: Redis is paused with
+-- the command queued, the backend is terminated while it waits for the
+-- reply, and the reply, when it comes, is dropped by the worker. The write
+-- still lands, and the worker goes on serving everyone else.
+
+select current_database() as db \gset
+\setenv PGDATABASE :db
+
+\! redis-cli client pause 10000 write > /dev/null
+\! psql -X -c "insert into db15_proxy values ('proxy_c', 'w')" > /dev/null 2>&1 &
+
+do $$
+  declare
+    p int;
+  begin
+    for i in 1..200 loop
+      perform pg_stat_clear_snapshot();
+      select into p pid from pg_stat_activity
+        where query like 'insert into db15_proxy values (''proxy_c''%'
+          and wait_event_type = 'Extension';
+      exit when p is not null;
+      perform pg_sleep(0.05);
+    end loop;
+    raise notice 'terminated: %', coalesce(pg_terminate_backend(p), false);
+  end;
+$$;
+
+\! redis-cli client unpause > /dev/null
+\! for i in $(seq 50); do [ "$(redis-cli -n 15 exists proxy_c)" = 1 ] && break; sleep 0.1; done
+
+select * from db15_proxy order by key;
+
+select count(*) from pg_stat_activity where backend_type = 'redis_fdw proxy';
+
+delete from db15_proxy;
+
+delete from db15_proxy_h;
+
+drop foreign table db15_proxy;
+
+drop foreign table db15_proxy_h;
+
+drop user mapping for public server proxysrv;
+
+drop server proxysrv;
+
+\! redis-cli -n 15 keys 'proxy*' | sort